@@ -2,18 +2,20 @@
  * Copyright (c) 2014, Zhiyong Liu <NeeseNK at gmail dot com>
  * All rights reserved.
  */
-#define __GNU_SOURCE
+#define _GNU_SOURCE
 #include <math.h>
 #include <sys/types.h>
 #include <regex.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
-#include <ctype.h>
 #include <stdint.h>
+#include <limits.h>
 #include <string.h>
 #include <stdbool.h>
 #include <time.h>
+#include <pthread.h>
+#include <locale.h>
 #include "express.h"
 
 typedef struct token_value value_t;
@@ -47,6 +49,7 @@ enum {
     OP_AND,         // &&
     OP_OR,          // ||
     OP_SEP,         // ,
+    OP_DICT,        // 字典编码的变量和它的比较
     OP_MAX,
 };
 
@@ -71,20 +74,85 @@ struct token {
     unsigned char   type;       // 类型
     unsigned char   nparam;     // 参数个数
     unsigned short  subtype;    // 子类型
+    uint32_t        srcpos;     // 在表达式字符串中的位置, 用于报告错误
     union {
         struct { uint32_t pos; uint32_t len; } str;
         const char *ptr;
+        const struct function *fn;
+        const struct dict_ref *dict;
         double num;
     };
 };
 
 struct bufflist { struct bufflist *next; char buff[]; };
+
+// 字典编码的变量, fetcher返回字典中的下标, 和常量字符串的比较对每个字典项预先计算
+struct dict_ref {
+    const char *name;           // 变量名
+    const char *const *values;  // 字典
+    size_t size;                // 字典的大小
+    int op;                     // OP_LT等比较运算符, OP_FUNC为in(), 0为只解码
+    bool swap;                  // 常量在运算符左边
+    size_t nconst;              // 比较的常量个数
+    const char **consts;        // 比较的常量
+    unsigned char *table;       // 每个字典项的比较结果
+};
+
+// 增量计算的状态, rpn中每个token都是以它结尾的子表达式的根
+struct incremental {
+    size_t  *start;             // 每个子表达式在rpn中的起始位置
+    ssize_t *outer;             // 从该位置开始的最大子表达式, 没有为-1
+    ssize_t *down;              // 起始位置相同的下一个更小的子表达式, 没有为-1
+    size_t  *dirty;             // 变化的叶子数的前缀和
+    value_t *cache;             // 每个子表达式上次的计算结果
+    struct { char *ptr; size_t cap; } *owned; // cache中字符串的副本
+    bool     ready;             // cache是否已经完整计算过
+};
+
+// 批量编译使用的内存池, 按块分配, 整体释放
+struct arena { struct arena *next; size_t used; size_t capacity; char buff[]; };
+#define ARENA_BLOCK (256 << 10)
+#define ALIGN8(n) (((n) + 7) & ~(size_t)7)
+
 struct express {
     struct token *rpn;          // 运算符逆波兰表示
     size_t size;                // rpn的长度
     char *strbuff;              // 保存token中的id和str
     value_t *stack;  // 计算时的参数栈
     struct bufflist *list;      // 保存计算时分配的内存，计算结束是释放
+    struct bufflist *pinned;    // 常量折叠等生成的字符串，销毁时释放
+    struct incremental *inc;    // 增量计算状态, 第一次调用express_update时创建
+    struct result_cache *cache; // 结果缓存, express_cache_enable时创建
+    bool in_arena;              // 是否由express_compile_many分配在arena中
+};
+
+// 结果缓存的项, 一次分配, keys后面保存字符串
+struct cache_entry {
+    struct cache_entry *hnext;      // 哈希冲突链
+    struct cache_entry *prev, *next;// LRU链表
+    uint64_t hash;
+    size_t size;                    // 占用的内存
+    value_t result;
+    value_t keys[];                 // 每个变量的值
+};
+
+// 以变量的值为键的结果缓存, 变量按名字去重, token的subtype为变量的下标
+struct result_cache {
+    size_t nvar;
+    const char **names;             // 每个变量的名字
+    value_t *vars;                  // 本次计算获取的变量值
+    struct cache_entry **buckets;
+    size_t mask;
+    struct cache_entry lru;         // 哨兵, lru.next为最近使用的
+    size_t limit;                   // 内存上限
+    struct express_cache_stats stats;
+};
+
+struct express_batch {
+    struct arena **arenas;      // 每个线程一个arena
+    size_t narena;
+    struct express **exprs;     // 编译成功的表达式, 释放时清理它们的运行状态
+    size_t size;
 };
 
 struct token_buff {
@@ -107,11 +175,27 @@ typedef value_t (*token_fn)(value_t *arg, size_t narg, struct express *expr);
 // 函数结构定义
 struct function
 {
-    char     *name;
-    token_fn  func;
-    size_t    min;
-    size_t    max;
+    char       *name;
+    token_fn    func;
+    size_t      min;
+    size_t      max;
+    int         flags;  // EXPRESS_FN_PURE
+    express_fn  ufunc;  // 用户注册的函数, func为NULL时使用
+    void       *udata;  // 透传给ufunc
+};
+
+// 字符分类表, 不依赖locale
+enum { C_SPACE = 1, C_DIGIT = 2, C_ALPHA = 4, C_ID = 8 };
+static const unsigned char char_class[256] = {
+    [' '] = C_SPACE, ['\t'] = C_SPACE, ['\n'] = C_SPACE,
+    ['\v'] = C_SPACE, ['\f'] = C_SPACE, ['\r'] = C_SPACE,
+    ['0' ... '9'] = C_DIGIT | C_ID,
+    ['a' ... 'z'] = C_ALPHA | C_ID,
+    ['A' ... 'Z'] = C_ALPHA | C_ID,
+    ['_'] = C_ALPHA | C_ID, ['$'] = C_ALPHA | C_ID,
+    ['.'] = C_ID,
 };
+#define CHAR_IS(c, cls) (char_class[(unsigned char)(c)] & (cls))
 
 // 分配一段内存保存在expr上，计算完之后会自动释放
 static inline char *express_alloc(struct express *expr, size_t size)
@@ -216,17 +300,26 @@ enum {
     F_MAX,
 };
 
+#define PURE EXPRESS_FN_PURE
 static const struct function token_funcs[F_MAX] = {
-    { NULL,     NULL,       0,      0 },
-    { "strcmp", fn_strcmp,  2,      2 },
-    { "strlen", fn_strlen,  1,      1 },
-    { "strstr", fn_strstr,  2,      2 },
-    { "pow",    fn_pow,     2,      2 },
-    { "in",     fn_in,      2,      ~0},
-    { "case",   fn_case,    3,      3 },
-    { "time",   fn_time,    0,      0 },
-    { "substr", fn_substr,  2,      3 },
+    { NULL,     NULL,       0,      0,  0    },
+    { "strcmp", fn_strcmp,  2,      2,  PURE },
+    { "strlen", fn_strlen,  1,      1,  PURE },
+    { "strstr", fn_strstr,  2,      2,  PURE },
+    { "pow",    fn_pow,     2,      2,  PURE },
+    { "in",     fn_in,      2,      ~0, PURE },
+    { "case",   fn_case,    3,      3,  PURE },
+    { "time",   fn_time,    0,      0,  0    },
+    { "substr", fn_substr,  2,      3,  PURE },
 };
+#undef PURE
+
+// 用户注册的函数，开放寻址的哈希表，容量是2的幂
+static struct {
+    struct function **slots;
+    size_t capacity;
+    size_t size;
+} registry;
 
 #define FUNC(ID) (len == strlen(token_funcs[ID].name) && memcmp(func, token_funcs[ID].name, len) == 0) ? (ID) : 0
 static inline int check_function(const char *func, size_t len)
@@ -254,6 +347,83 @@ static inline int check_function(const char *func, size_t len)
     return 0;
 }
 
+// FNV-1a
+static inline uint64_t hash_bytes(const void *ptr, size_t len, uint64_t h)
+{
+    const unsigned char *p = ptr;
+    while (len-- > 0)
+        h = (h ^ *p++) * 0x100000001b3ULL;
+    return h;
+}
+
+#define HASH_INIT 0xcbf29ce484222325ULL
+static inline struct function **registry_slot(const char *name, size_t len)
+{
+    size_t i = hash_bytes(name, len, HASH_INIT) & (registry.capacity - 1);
+    for (;; i = (i + 1) & (registry.capacity - 1)) {
+        struct function *fn = registry.slots[i];
+        if (fn == NULL || (strncmp(fn->name, name, len) == 0 && fn->name[len] == 0))
+            return &registry.slots[i];
+    }
+}
+
+// 查找函数, 内置函数优先
+static inline const struct function *lookup_function(const char *func, size_t len)
+{
+    int id = check_function(func, len);
+    if (id)
+        return &token_funcs[id];
+    if (registry.size == 0)
+        return NULL;
+    return *registry_slot(func, len);
+}
+
+
+int express_register_function(const char *name, express_fn func, size_t min, size_t max,
+                              int flags, void *udata)
+{
+    size_t i = 0, len = 0;
+    struct function *fn = NULL, **slot = NULL;
+
+    if (name == NULL || func == NULL || min > max || !CHAR_IS(*name, C_ALPHA))
+        return -1;
+    for (len = 0; name[len]; len++) {
+        if (!CHAR_IS(name[len], C_ID))
+            return -1;
+    }
+    if (lookup_function(name, len))
+        return -1;
+
+    // 负载超过一半时扩容
+    if ((registry.size + 1) * 2 > registry.capacity) {
+        struct function **old = registry.slots;
+        size_t capacity = registry.capacity;
+        registry.capacity = capacity ? capacity * 2 : 16;
+        registry.slots = calloc(registry.capacity, sizeof(*registry.slots));
+        assert(registry.slots);
+        for (i = 0; i < capacity; i++) {
+            if (old[i])
+                *registry_slot(old[i]->name, strlen(old[i]->name)) = old[i];
+        }
+        free(old);
+    }
+
+    fn = calloc(1, sizeof(*fn) + len + 1);
+    assert(fn);
+    fn->name  = memcpy((char *)(fn + 1), name, len + 1);
+    fn->min   = min;
+    fn->max   = max;
+    fn->flags = flags;
+    fn->ufunc = func;
+    fn->udata = udata;
+    slot = registry_slot(name, len);
+    assert(*slot == NULL);
+    *slot = fn;
+    registry.size++;
+
+    return 0;
+}
+
 static inline struct token *token_pushback(struct token_buff *buff)
 {
     if (buff->capacity <= buff->size) {
@@ -270,24 +440,92 @@ static inline struct token *token_pushback(struct token_buff *buff)
 
 static inline const char *skip_blank(const char *pos)
 {
-    while (isspace(*pos))
+    while (CHAR_IS(*pos, C_SPACE))
         pos++;
     return pos;
 }
 
 static inline const char *skip_digits(const char *pos)
 {
-	while (isdigit(*pos))
+	while (CHAR_IS(*pos, C_DIGIT))
 		pos++;
 	return pos;
 }
 
+// 10的整数次幂在double中都是精确的
+static const double pow10_exact[] = {
+    1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+};
+
+// 解析十进制数字, 尾数不超过2^53且指数不超过22时结果是精确的(Clinger),
+// 其他情况(十六进制, inf, 超长的数字等)返回false交给strtod
+static inline bool fast_number(const char *pos, const char **end, double *v)
+{
+    const char *beg = NULL, *dot = NULL;
+    uint64_t m = 0;
+    int exp = 0, esign = 1, ndigit = 0;
+    bool neg = (*pos == '-');
+
+    if (*pos == '-' || *pos == '+')
+        pos++;
+    for (beg = pos; CHAR_IS(*pos, C_DIGIT) || (*pos == '.' && !dot); pos++) {
+        if (*pos == '.') {
+            dot = pos;
+        } else if (m || *pos != '0' || dot) {
+            m = m * 10 + (*pos - '0');
+            if (++ndigit > 19)
+                return false;
+        }
+    }
+    if (pos == beg || (pos == beg + 1 && dot) || *pos == 'x' || *pos == 'X')
+        return false;
+    exp = dot ? -(int)(pos - dot - 1) : 0;
+    if (*pos == 'e' || *pos == 'E') {
+        const char *p = pos + 1, *digits = NULL;
+        int e = 0;
+        if (*p == '-' || *p == '+')
+            esign = (*p++ == '-') ? -1 : 1;
+        digits = p, p = skip_digits(p);
+        if (p == digits || p - digits > 3)
+            return false;
+        for (; digits < p; digits++)
+            e = e * 10 + (*digits - '0');
+        exp += esign * e, pos = p;
+    }
+    if (m >> 53)
+        return false;
+    if (exp >= 0 && exp <= 22)
+        *v = (double)m * pow10_exact[exp];
+    else if (exp < 0 && exp >= -22)
+        *v = (double)m / pow10_exact[-exp];
+    else
+        return false;
+    *v = neg ? -*v : *v;
+    *end = pos;
+
+    return true;
+}
+
+// strtod使用的C locale, 小数点不受LC_NUMERIC影响
+static locale_t c_locale;
+static pthread_once_t c_locale_once = PTHREAD_ONCE_INIT;
+static void c_locale_init(void)
+{
+    c_locale = newlocale(LC_NUMERIC_MASK, "C", (locale_t)0);
+}
+
 static inline int parse_number(const char *expr, const char **ppos, struct token *token)
 {
     char *pos = NULL;
-    double v = strtod(*ppos, &pos);
+    double v = 0;
+    if (fast_number(*ppos, (const char **)&pos, &v))
+        goto DONE;
+    pthread_once(&c_locale_once, c_locale_init);
+    v = c_locale ? strtod_l(*ppos, &pos, c_locale) : strtod(*ppos, &pos);
     if (pos == *ppos)
         return false;
+DONE:
     token->type = OP_NUM;
     token->num  = v;
     *ppos   = pos;
@@ -327,12 +565,12 @@ static inline int parse_id(const char *expr, const char **ppos, struct token_buf
     const char *pos = *ppos, *end = NULL;
     struct token *token = NULL;
     // a-zA-z 0-9 _ $ .
-    while (isalnum(*pos) || isalpha(*pos) || *pos == '.')
+    while (CHAR_IS(*pos, C_ID))
         pos++;
     end = pos, pos = skip_blank(pos);
     if (*pos == '(') { // 是函数
         token = token_pushback(stack);
-        if ((token->subtype = check_function(*ppos, end - *ppos)) == 0)
+        if ((token->fn = lookup_function(*ppos, end - *ppos)) == NULL)
             return false;
         token->type = OP_FUNC;
     } else { // 变量名
@@ -346,8 +584,8 @@ static inline int parse_id(const char *expr, const char **ppos, struct token_buf
     return token->type;
 }
 
-// 检查rpn是否合法
-static inline int check_RPN(struct token *rpn, size_t size)
+// 检查rpn是否合法, 不合法时bad为出错的token的下标, 在结尾才能发现的错误为size
+static inline int check_RPN(struct token *rpn, size_t size, size_t *bad)
 {
     size_t nparam = 0, i;
     for (i = 0; i < size; i++) {
@@ -355,18 +593,34 @@ static inline int check_RPN(struct token *rpn, size_t size)
         if (t->type == OP_NUM || t->type == OP_ID || t->type == OP_STR) {
             nparam++;
         } else {
-            const struct function *fn = &token_funcs[t->subtype];
+            *bad = i;
+            if (t->type != OP_FUNC && (t->type < OP_NOT || t->type > OP_OR))
+                return false;
             if (nparam < t->nparam)
                 return false;
-            if (t->type == OP_FUNC && (t->nparam < fn->min || t->nparam > fn->max))
+            if (t->type == OP_FUNC && (t->nparam < t->fn->min || t->nparam > t->fn->max))
                 return false;
             nparam -= t->nparam - 1;
         }
     }
 
+    *bad = size;
     return nparam == 1;
 }
 
+// 是否刚结束一个操作数
+static inline bool operand_end(int type)
+{
+    return type == OP_NUM || type == OP_ID || type == OP_STR || type == OP_END;
+}
+
+// 是否开始一个操作数
+static inline bool operand_begin(int type)
+{
+    return type == OP_NUM || type == OP_ID || type == OP_STR || type == OP_BEG
+        || type == OP_NOT || type == OP_BITCOMP;
+}
+
 // 返回token的长度
 static inline int token_len(int type)
 {
@@ -459,56 +713,74 @@ static inline void opera_push(int type, struct token_buff *rpn, struct token_buf
 }
 
 // http://en.wikipedia.org/wiki/Shunting-yard_algorithm
-static int express_parse(const char *expr, struct token_buff *rpn, struct token_buff *stack)
+static int express_parse(const char *expr, struct token_buff *rpn, struct token_buff *stack,
+                         const char **errpos)
 {
     int last = 0, type = 0;
-    const char *pos = expr;
+    const char *pos = expr, *start = NULL;
+    size_t bad = 0;
 
     for (;;) {
         last = type, type = 0;
         if (*(pos = skip_blank(pos)) == 0)
             break;
-        switch ((type = token_type(pos, last))) {
+        type = token_type(pos, last);
+        // 两个操作数之间缺少运算符, 或者二元运算符缺少左操作数
+        if (type != OP_SEP && type != OP_END && operand_end(last) == operand_begin(type))
+            goto FAIL;
+        start = pos;
+        switch (type) {
         case OP_ID:
             if (!(type = parse_id(expr, &pos, rpn, stack)))
-                return false;
+                goto FAIL;
             break;
         case OP_NUM:
             if (!parse_number(expr, &pos, token_pushback(rpn)))
-                return false;
+                goto FAIL;
             break;
         case OP_STR:
             if (!parse_str(expr, &pos, token_pushback(rpn)))
-                return false;
+                goto FAIL;
             break;
         case OP_SEP:
             if (!argument_push(rpn, stack))
-                return false;
+                goto FAIL;
             break;
         case OP_END: // )
             if (!parenth_end(last, rpn, stack))
-                return false;
+                goto FAIL;
             break;
         case OP_BEG: // (
             token_pushback(stack)->type = type;
             break;
         case 0:
-            return false;
+            goto FAIL;
         default:
             opera_push(type, rpn, stack);
             break;
         }
+        // 新的token在rpn或者stack的顶部
+        if (type == OP_ID || type == OP_NUM || type == OP_STR)
+            rpn->tokens[rpn->size - 1].srcpos = start - expr;
+        else if (type != OP_SEP && type != OP_END)
+            stack->tokens[stack->size - 1].srcpos = start - expr;
         pos += token_len(type);
     }
 
-    if (stack->size > 0) {
+    // 栈中剩下的(都没有匹配的), pos在表达式的结尾
+    while (stack->size) {
         if (stack->tokens[stack->size - 1].type == OP_BEG)
-            return false;
-        while (stack->size)
-            *token_pushback(rpn) = stack->tokens[--stack->size];
+            goto FAIL;
+        *token_pushback(rpn) = stack->tokens[--stack->size];
     }
 
-    return check_RPN(rpn->tokens, rpn->size);
+    if (check_RPN(rpn->tokens, rpn->size, &bad))
+        return true;
+    if (bad < rpn->size)
+        pos = expr + rpn->tokens[bad].srcpos;
+FAIL:
+    *errpos = pos;
+    return false;
 }
 
 static inline void bufflist_clean(struct express *expr, const char *except)
@@ -529,17 +801,78 @@ static inline void bufflist_clean(struct express *expr, const char *except)
         expr->list = save, save->next = NULL;
 }
 
+// 释放mark之后分配的内存, 保留之前express_calculate返回的字符串
+static inline void bufflist_rollback(struct express *expr, struct bufflist *mark)
+{
+    while (expr->list != mark) {
+        struct bufflist *ptr = expr->list;
+        expr->list = ptr->next;
+        free(ptr);
+    }
+}
+
+static void incremental_destroy(struct incremental *inc, size_t size)
+{
+    size_t i = 0;
+    if (inc == NULL)
+        return;
+    for (i = 0; i < size; i++)
+        free(inc->owned[i].ptr);
+    free(inc->owned);
+    free(inc->cache);
+    free(inc->dirty);
+    free(inc->down);
+    free(inc->outer);
+    free(inc->start);
+    free(inc);
+}
+
+static void cache_destroy(struct result_cache *c);
+// 释放表达式运行时分配的内存
+static void express_release(struct express *expr)
+{
+    incremental_destroy(expr->inc, expr->size);
+    expr->inc = NULL;
+    cache_destroy(expr->cache);
+    expr->cache = NULL;
+    bufflist_clean(expr, NULL);
+    while (expr->pinned) {
+        struct bufflist *ptr = expr->pinned;
+        expr->pinned = ptr->next;
+        free(ptr);
+    }
+}
+
 void express_destroy(struct express *expr)
 {
-    if (expr) {
-        bufflist_clean(expr, NULL);
-        free(expr->rpn);
-        free(expr->strbuff);
-        free(expr->stack);
+    // arena中的表达式由express_batch_destroy释放
+    if (expr && !expr->in_arena) {
+        express_release(expr);
         free(expr);
     }
 }
 
+static void *arena_alloc(struct arena **head, size_t size)
+{
+    struct arena *a = *head;
+    size = ALIGN8(size);
+    if (a == NULL || a->capacity - a->used < size) {
+        size_t capacity = size > ARENA_BLOCK ? size : ARENA_BLOCK;
+        a = malloc(sizeof(*a) + capacity);
+        assert(a);
+        a->used = 0, a->capacity = capacity;
+        // 大块单独分配, 不影响当前块的使用
+        if (size > ARENA_BLOCK / 2 && *head) {
+            a->next = (*head)->next, (*head)->next = a;
+        } else {
+            a->next = *head, *head = a;
+        }
+    }
+    a->used += size;
+
+    return a->buff + a->used - size;
+}
+
 // 去除字符串中的转义符
 static inline size_t copystr(char *dest, const char *str, size_t len)
 {
@@ -560,34 +893,39 @@ static inline size_t copystr(char *dest, const char *str, size_t len)
     return len + 1;
 }
 
-struct express *express_create(const char *str)
+static void express_fold(struct express *expr);
+// 编译表达式, 表达式对象, rpn, 栈和字符串在同一块内存中, arena为NULL时用malloc分配
+static struct express *express_build(const char *str, struct token_buff *rpn, struct token_buff *stack,
+                                     struct arena **arena, const char **errpos)
 {
     struct express *expr = NULL;
-    struct token_buff rpn, stack;
-    size_t i = 0, len = 0, off = 0;
-
-    memset(&rpn, 0, sizeof(rpn));
-    memset(&stack, 0, sizeof(stack));
-    if (!express_parse(str, &rpn, &stack))
-        goto DONE;
+    size_t i = 0, len = 0, off = 0, total = 0;
+    char *ptr = NULL;
 
-    expr = calloc(1, sizeof(*expr));
-    assert(expr);
-    expr->rpn = calloc(rpn.size, sizeof(*expr->rpn));
-    assert(expr->rpn);
+    if (!express_parse(str, rpn, stack, errpos))
+        return NULL;
 
     // 计算需要保存的字符串的总长度
-    for (i = 0; i < rpn.size; i++) {
-        struct token *token = &rpn.tokens[i];
+    for (i = 0; i < rpn->size; i++) {
+        struct token *token = &rpn->tokens[i];
         if (token->type == OP_ID || token->type == OP_STR)
             len += token->str.len + 1;
     }
 
-    expr->strbuff = calloc(len, 1);
-    assert(expr->strbuff);
+    total = ALIGN8(sizeof(*expr)) + rpn->size * (sizeof(struct token) + sizeof(value_t)) + len;
+    ptr = arena ? arena_alloc(arena, total) : malloc(total);
+    assert(ptr);
+    expr = (struct express *)ptr;
+    memset(expr, 0, sizeof(*expr));
+    expr->in_arena = (arena != NULL);
+    expr->rpn = (struct token *)(ptr + ALIGN8(sizeof(*expr)));
+    // 计算时使用的栈
+    expr->stack = (value_t *)(expr->rpn + rpn->size);
+    expr->strbuff = (char *)(expr->stack + rpn->size);
+
     // 复制token
-    for (i = 0; i < rpn.size; i++) {
-        struct token *token = &rpn.tokens[i];
+    for (i = 0; i < rpn->size; i++) {
+        struct token *token = &rpn->tokens[i];
         expr->rpn[i] = *token;
         if (token->type == OP_ID || token->type == OP_STR) {
             expr->rpn[i].ptr = expr->strbuff + off;
@@ -596,20 +934,131 @@ struct express *express_create(const char *str)
             assert(off <= len);
         }
     }
-    expr->size = rpn.size;
+    expr->size = rpn->size;
+    express_fold(expr);
 
-    // 分配计算时使用的栈
-    expr->stack = calloc(expr->size, sizeof(value_t));
-    assert(expr->stack);
-DONE:
+    return expr;
+}
+
+struct express *express_create(const char *str)
+{
+    struct express *expr = NULL;
+    struct token_buff rpn, stack;
+    const char *errpos = NULL;
+
+    memset(&rpn, 0, sizeof(rpn));
+    memset(&stack, 0, sizeof(stack));
+    expr = express_build(str, &rpn, &stack, NULL, &errpos);
     free(stack.tokens);
     free(rpn.tokens);
     return expr;
 }
 
+// 一个线程编译[beg, end)范围内的表达式
+struct compile_job {
+    const char *const *exprs;
+    struct express **out;
+    long *errpos;
+    size_t beg, end;
+    struct arena *arena;
+    pthread_t tid;
+    bool started;
+};
+
+static void *compile_worker(void *arg)
+{
+    struct compile_job *job = arg;
+    struct token_buff rpn, stack; // 所有表达式复用
+    const char *errpos = NULL;
+    size_t i = 0;
+
+    memset(&rpn, 0, sizeof(rpn));
+    memset(&stack, 0, sizeof(stack));
+    for (i = job->beg; i < job->end; i++) {
+        rpn.size = stack.size = 0;
+        job->out[i] = express_build(job->exprs[i], &rpn, &stack, &job->arena, &errpos);
+        if (job->errpos)
+            job->errpos[i] = job->out[i] ? -1 : errpos - job->exprs[i];
+    }
+    free(stack.tokens);
+    free(rpn.tokens);
+
+    return NULL;
+}
+
+struct express_batch *express_compile_many(const char *const *exprs, size_t n, struct express **out,
+                                           long *errpos, int nthreads)
+{
+    struct express_batch *batch = NULL;
+    struct compile_job *jobs = NULL;
+    size_t i = 0, j = 0, njob = 0;
+
+    njob = nthreads > 1 ? (size_t)nthreads : 1;
+    if (njob > n)
+        njob = n ? n : 1;
+    jobs = calloc(njob, sizeof(*jobs));
+    assert(jobs);
+    for (i = 0; i < njob; i++) {
+        jobs[i].exprs  = exprs;
+        jobs[i].out    = out;
+        jobs[i].errpos = errpos;
+        jobs[i].beg    = n * i / njob;
+        jobs[i].end    = n * (i + 1) / njob;
+    }
+    // 第一个任务在当前线程执行, 线程创建失败时也在当前线程执行
+    for (i = 1; i < njob; i++) {
+        jobs[i].started = pthread_create(&jobs[i].tid, NULL, compile_worker, &jobs[i]) == 0;
+        if (!jobs[i].started)
+            compile_worker(&jobs[i]);
+    }
+    compile_worker(&jobs[0]);
+    for (i = 1; i < njob; i++) {
+        if (jobs[i].started)
+            pthread_join(jobs[i].tid, NULL);
+    }
+
+    batch = calloc(1, sizeof(*batch));
+    assert(batch);
+    batch->arenas = calloc(njob, sizeof(*batch->arenas));
+    batch->exprs = calloc(n ? n : 1, sizeof(*batch->exprs));
+    assert(batch->arenas && batch->exprs);
+    for (i = 0; i < njob; i++)
+        batch->arenas[batch->narena++] = jobs[i].arena;
+    for (i = 0, j = 0; i < n; i++) {
+        if (out[i])
+            batch->exprs[j++] = out[i];
+    }
+    batch->size = j;
+    free(jobs);
+
+    return batch;
+}
+
+void express_batch_destroy(struct express_batch *batch)
+{
+    size_t i = 0;
+    if (batch == NULL)
+        return;
+    for (i = 0; i < batch->size; i++)
+        express_release(batch->exprs[i]);
+    for (i = 0; i < batch->narena; i++) {
+        while (batch->arenas[i]) {
+            struct arena *a = batch->arenas[i];
+            batch->arenas[i] = a->next;
+            free(a);
+        }
+    }
+    free(batch->exprs);
+    free(batch->arenas);
+    free(batch);
+}
+
 static inline value_t FUNC_OPT(struct token *token, value_t *arg, struct express *expr)
 {
-    return token_funcs[token->subtype].func(arg, token->nparam, expr);
+    const struct function *fn = token->fn;
+    if (fn->func)
+        return fn->func(arg, token->nparam, expr);
+    return fn->ufunc(arg, token->nparam, fn->udata);
 }
 
 static inline value_t REGEX_OPT(value_t *arg)
@@ -627,28 +1076,111 @@ static inline value_t REGEX_OPT(value_t *arg)
     return NUM_VAL(rc);
 }
 
-static inline value_t FETCH_OPT(struct token *token, fetch_value_fn fetcher, void *ctx)
+#define NUM_OPT(ST, OP) NUM_VAL(ST(0) OP ST(1))
+#define STR_OPT(ST, OP) NUM_VAL(COMP(0, 1, ST, OP))
+static inline value_t FETCH_OPT(const char *name, fetch_value_fn fetcher, void *ctx)
 {
     value_t v = { .type = TV_NONE };
-    assert(token->ptr != NULL);
+    assert(name != NULL);
     if (fetcher) {
-        v = fetcher(ctx, token->ptr);
+        v = fetcher(ctx, name);
         assert(v.type == TV_NONE || v.type == TV_NUM || v.type == TV_STR);
     }
     if (v.type == TV_NONE)
-        v = STR_VAL(token->ptr);
+        v = STR_VAL(name);
+
+    return v;
+}
 
+// 按原来的运算规则计算变量和常量的比较
+static value_t dict_compare(const struct dict_ref *d, value_t v)
+{
+    value_t arg[2] = { v, STR_VAL(d->consts[0]) };
+    size_t i = 0;
+    int rc = 0;
+
+    if (d->op == OP_FUNC) {
+        for (i = 0; i < d->nconst && !rc; i++) {
+            arg[1] = STR_VAL(d->consts[i]);
+            rc = COMP(0, 1, NUM, ==);
+        }
+        return NUM_VAL(rc);
+    }
+    if (d->swap)
+        arg[1] = v, arg[0] = STR_VAL(d->consts[0]);
+    switch (d->op) {
+    case OP_LT:     return STR_OPT(NUM,  <);
+    case OP_LE:     return STR_OPT(NUM, <=);
+    case OP_GT:     return STR_OPT(NUM,  >);
+    case OP_GE:     return STR_OPT(NUM, >=);
+    case OP_EQ:     return STR_OPT(NUM, ==);
+    case OP_NOTEQ:  return STR_OPT(NUM, !=);
+    default: assert(0 && "unknow type");
+    }
     return v;
 }
 
+// 计算字典变量, v为获取到的变量值
+static inline value_t dict_value(const struct dict_ref *d, value_t v)
+{
+    if (v.type == TV_NUM && v.num >= 0 && v.num < d->size) {
+        size_t code = v.num;
+        return d->op ? NUM_VAL(d->table[code]) : STR_VAL(d->values[code]);
+    }
+
+    // 不是合法的编码, 按原值计算
+    return d->op ? dict_compare(d, v) : v;
+}
+
+static inline value_t DICT_OPT(struct token *token, fetch_value_fn fetcher, void *ctx)
+{
+    return dict_value(token->dict, FETCH_OPT(token->dict->name, fetcher, ctx));
+}
+
 static inline value_t NOT_OPT(value_t *arg)
 {
     return NUM_VAL(arg[0].type == TV_NUM ? !arg[0].num : !arg[0].str);
 }
 
-#define NUM_OPT(ST, OP) NUM_VAL(ST(0) OP ST(1))
-#define STR_OPT(ST, OP) NUM_VAL(COMP(0, 1, ST, OP))
-value_t express_calculate(struct express *expr, fetch_value_fn fetcher, void *ctx)
+// 计算单个token, arg指向它的参数
+static inline value_t token_eval(struct token *t, value_t *arg, struct express *expr,
+                                 fetch_value_fn fetcher, void *ctx)
+{
+    switch (t->type) {
+    case OP_BITCOMP:    return NUM_VAL(~LONG(0));
+    case OP_NOT:        return NOT_OPT(arg);
+    case OP_MULTI:      return NUM_OPT(NUM,  *);
+    case OP_DIVI:       return NUM_OPT(NUM,  /);
+    case OP_MOD:        return NUM_OPT(LONG, %);
+    case OP_ADD:        return NUM_OPT(NUM,  +);
+    case OP_SUB:        return NUM_OPT(NUM,  -);
+    case OP_SHIFTLEFT:  return NUM_OPT(LONG,<<);
+    case OP_SHIFTRIGHT: return NUM_OPT(LONG,>>);
+    case OP_BITAND:     return NUM_OPT(LONG, &);
+    case OP_BITXOR:     return NUM_OPT(LONG, ^);
+    case OP_BITOR:      return NUM_OPT(LONG, |);
+    case OP_AND:        return NUM_OPT(NUM, &&);
+    case OP_OR:         return NUM_OPT(NUM, ||);
+    case OP_LT:         return STR_OPT(NUM,  <);
+    case OP_LE:         return STR_OPT(NUM, <=);
+    case OP_GT:         return STR_OPT(NUM,  >);
+    case OP_GE:         return STR_OPT(NUM, >=);
+    case OP_EQ:         return STR_OPT(NUM, ==);
+    case OP_NOTEQ:      return STR_OPT(NUM, !=);
+    case OP_REGEX:      return REGEX_OPT(arg);
+    case OP_NUM:        return NUM_VAL(t->num);
+    case OP_STR:        return STR_VAL(t->ptr);
+    case OP_FUNC:       return FUNC_OPT(t, arg, expr);
+    case OP_ID:         return FETCH_OPT(t->ptr, fetcher, ctx);
+    case OP_DICT:       return DICT_OPT(t, fetcher, ctx);
+    default: assert(0 && "unknow type");
+    }
+    return (value_t) { .type = TV_NONE };
+}
+
+// 计算rpn, vars不为NULL时使用已经获取的变量值, 计算时分配的内存由调用者清理
+static inline value_t express_run(struct express *expr, fetch_value_fn fetcher, void *ctx,
+                                  const value_t *vars)
 {
     size_t i = 0, ss = 0;
     value_t *stack = expr->stack, *arg = NULL;
@@ -657,41 +1189,685 @@ value_t express_calculate(struct express *expr, fetch_value_fn fetcher, void *ct
         t = &expr->rpn[i];
         assert(t->nparam <= ss);
         arg = stack + ss - t->nparam;
-        switch (t->type) {
-        case OP_BITCOMP:    arg[0] = NUM_VAL(~LONG(0));break;
-        case OP_NOT:        arg[0] = NOT_OPT(arg);     break;
-        case OP_MULTI:      arg[0] = NUM_OPT(NUM,  *); break;
-        case OP_DIVI:       arg[0] = NUM_OPT(NUM,  /); break;
-        case OP_MOD:        arg[0] = NUM_OPT(LONG, %); break;
-        case OP_ADD:        arg[0] = NUM_OPT(NUM,  +); break;
-        case OP_SUB:        arg[0] = NUM_OPT(NUM,  -); break;
-        case OP_SHIFTLEFT:  arg[0] = NUM_OPT(LONG,<<); break;
-        case OP_SHIFTRIGHT: arg[0] = NUM_OPT(LONG,>>); break;
-        case OP_BITAND:     arg[0] = NUM_OPT(LONG, &); break;
-        case OP_BITXOR:     arg[0] = NUM_OPT(LONG, ^); break;
-        case OP_BITOR:      arg[0] = NUM_OPT(LONG, |); break;
-        case OP_AND:        arg[0] = NUM_OPT(NUM, &&); break;
-        case OP_OR:         arg[0] = NUM_OPT(NUM, ||); break;
-        case OP_LT:         arg[0] = STR_OPT(NUM,  <); break;
-        case OP_LE:         arg[0] = STR_OPT(NUM, <=); break;
-        case OP_GT:         arg[0] = STR_OPT(NUM,  >); break;
-        case OP_GE:         arg[0] = STR_OPT(NUM, >=); break;
-        case OP_EQ:         arg[0] = STR_OPT(NUM, ==); break;
-        case OP_NOTEQ:      arg[0] = STR_OPT(NUM, !=); break;
-        case OP_REGEX:      arg[0] = REGEX_OPT(arg);   break;
-        case OP_NUM:        arg[0] = NUM_VAL(t->num);  break;
-        case OP_STR:        arg[0] = STR_VAL(t->ptr);  break;
-        case OP_FUNC:       arg[0] = FUNC_OPT(t, arg, expr); break;
-        case OP_ID:         arg[0] = FETCH_OPT(t, fetcher, ctx); break;
-        default: assert(0 && "unknow type");
-        }
+        if (vars && t->type == OP_ID)
+            arg[0] = vars[t->subtype];
+        else if (vars && t->type == OP_DICT)
+            arg[0] = dict_value(t->dict, vars[t->subtype]);
+        else
+            arg[0] = token_eval(t, arg, expr, fetcher, ctx);
         ss = ss + 1 - t->nparam;
         assert(ss <= expr->size);
     }
 
     assert(ss == 1);
+    return stack[0];
+}
+
+static void cache_destroy(struct result_cache *c)
+{
+    struct cache_entry *e = NULL;
+    if (c == NULL)
+        return;
+    while ((e = c->lru.next) != &c->lru) {
+        c->lru.next = e->next;
+        free(e);
+    }
+    free(c->buckets);
+    free(c->vars);
+    free(c->names);
+    free(c);
+}
+
+static inline uint64_t hash_value(value_t v, uint64_t h)
+{
+    h = hash_bytes(&v.type, sizeof(v.type), h);
+    if (v.type == TV_NUM)
+        return hash_bytes(&v.num, sizeof(v.num), h);
+    return v.str ? hash_bytes(v.str, strlen(v.str) + 1, h) : h;
+}
+
+static inline bool value_equal(value_t a, value_t b)
+{
+    if (a.type != b.type)
+        return false;
+    if (a.type == TV_NUM)
+        return memcmp(&a.num, &b.num, sizeof(a.num)) == 0;
+    return a.str == b.str || (a.str && b.str && strcmp(a.str, b.str) == 0);
+}
+
+// 复制字符串到项的尾部
+static inline value_t cache_copy(value_t v, char **pos)
+{
+    if (v.type == TV_STR && v.str) {
+        size_t len = strlen(v.str) + 1;
+        v.str = memcpy(*pos, v.str, len);
+        *pos += len;
+    }
+    return v;
+}
+
+static inline size_t cache_strlen(value_t v)
+{
+    return (v.type == TV_STR && v.str) ? strlen(v.str) + 1 : 0;
+}
+
+static inline void lru_unlink(struct cache_entry *e)
+{
+    e->prev->next = e->next;
+    e->next->prev = e->prev;
+}
+
+static inline void lru_push(struct result_cache *c, struct cache_entry *e)
+{
+    e->next = c->lru.next, e->prev = &c->lru;
+    c->lru.next->prev = e, c->lru.next = e;
+}
+
+// 淘汰最久没有使用的项
+static void cache_evict(struct result_cache *c)
+{
+    struct cache_entry *e = c->lru.prev, **pp = &c->buckets[e->hash & c->mask];
+    while (*pp != e)
+        pp = &(*pp)->hnext;
+    *pp = e->hnext;
+    lru_unlink(e);
+    c->stats.entries--;
+    c->stats.bytes -= e->size;
+    c->stats.evictions++;
+    free(e);
+}
+
+static void cache_insert(struct result_cache *c, uint64_t hash, value_t result)
+{
+    size_t i = 0, size = sizeof(struct cache_entry) + c->nvar * sizeof(value_t) + cache_strlen(result);
+    struct cache_entry *e = NULL;
+    char *pos = NULL;
+
+    for (i = 0; i < c->nvar; i++)
+        size += cache_strlen(c->vars[i]);
+    if (size > c->limit)
+        return;
+    while (c->stats.bytes + size > c->limit)
+        cache_evict(c);
+
+    // 项数超过桶数时扩容
+    if (c->stats.entries >= c->mask + 1) {
+        struct cache_entry **old = c->buckets, *n = NULL;
+        size_t count = c->mask + 1;
+        c->mask = count * 2 - 1;
+        c->buckets = calloc(count * 2, sizeof(*c->buckets));
+        assert(c->buckets);
+        for (i = 0; i < count; i++) {
+            for (e = old[i]; e; e = n) {
+                n = e->hnext;
+                e->hnext = c->buckets[e->hash & c->mask];
+                c->buckets[e->hash & c->mask] = e;
+            }
+        }
+        free(old);
+    }
+
+    e = malloc(size);
+    assert(e);
+    e->hash = hash;
+    e->size = size;
+    pos = (char *)(e->keys + c->nvar);
+    for (i = 0; i < c->nvar; i++)
+        e->keys[i] = cache_copy(c->vars[i], &pos);
+    e->result = cache_copy(result, &pos);
+    e->hnext = c->buckets[hash & c->mask];
+    c->buckets[hash & c->mask] = e;
+    lru_push(c, e);
+    c->stats.entries++;
+    c->stats.bytes += size;
+}
+
+// 获取所有变量的值, 命中时直接返回上次的结果
+static value_t cache_run(struct express *expr, fetch_value_fn fetcher, void *ctx)
+{
+    struct result_cache *c = expr->cache;
+    struct cache_entry *e = NULL;
+    uint64_t hash = HASH_INIT;
+    size_t i = 0;
+    value_t v;
+
+    for (i = 0; i < c->nvar; i++) {
+        c->vars[i] = FETCH_OPT(c->names[i], fetcher, ctx);
+        hash = hash_value(c->vars[i], hash);
+    }
+    for (e = c->buckets[hash & c->mask]; e; e = e->hnext) {
+        if (e->hash != hash)
+            continue;
+        for (i = 0; i < c->nvar && value_equal(e->keys[i], c->vars[i]); i++)
+            ;
+        if (i == c->nvar) {
+            lru_unlink(e);
+            lru_push(c, e);
+            c->stats.hits++;
+            return e->result;
+        }
+    }
+
+    c->stats.misses++;
+    v = express_run(expr, fetcher, ctx, c->vars);
+    cache_insert(c, hash, v);
+
+    return v;
+}
+
+static inline value_t express_eval(struct express *expr, fetch_value_fn fetcher, void *ctx)
+{
+    if (expr->cache)
+        return cache_run(expr, fetcher, ctx);
+    return express_run(expr, fetcher, ctx, NULL);
+}
+
+// 给变量分配下标, 变量太多时返回false
+static bool cache_slots(struct express *expr, struct result_cache *c)
+{
+    size_t i = 0, j = 0;
+    c->nvar = 0;
+    for (i = 0; i < expr->size; i++) {
+        struct token *t = &expr->rpn[i];
+        const char *name = NULL;
+        if (t->type != OP_ID && t->type != OP_DICT)
+            continue;
+        name = t->type == OP_ID ? t->ptr : t->dict->name;
+        for (j = 0; j < c->nvar && strcmp(c->names[j], name) != 0; j++)
+            ;
+        if (j == c->nvar && c->nvar++ >= UINT16_MAX)
+            return false;
+        c->names[j] = name;
+        t->subtype = j;
+    }
+
+    return true;
+}
+
+// 清空缓存并重新分配变量下标, rpn改变之后调用
+static void cache_reset(struct express *expr)
+{
+    struct result_cache *c = expr->cache;
+    struct cache_entry *e = NULL;
+    while ((e = c->lru.next) != &c->lru) {
+        c->lru.next = e->next;
+        free(e);
+    }
+    c->lru.prev = &c->lru;
+    memset(c->buckets, 0, (c->mask + 1) * sizeof(*c->buckets));
+    c->stats.entries = c->stats.bytes = 0;
+    // 变量的个数不会增加
+    cache_slots(expr, c);
+}
+
+int express_cache_enable(struct express *expr, size_t max_bytes)
+{
+    size_t i = 0;
+    struct result_cache *c = NULL;
+
+    cache_destroy(expr->cache);
+    expr->cache = NULL;
+    if (max_bytes == 0)
+        return 0;
+    // 有非纯函数的表达式不能缓存
+    for (i = 0; i < expr->size; i++) {
+        struct token *t = &expr->rpn[i];
+        if (t->type == OP_FUNC && !(t->fn->flags & EXPRESS_FN_PURE))
+            return -1;
+    }
+
+    c = calloc(1, sizeof(*c));
+    assert(c);
+    c->names = calloc(expr->size, sizeof(*c->names));
+    c->vars  = calloc(expr->size, sizeof(*c->vars));
+    c->mask  = 63;
+    c->buckets = calloc(c->mask + 1, sizeof(*c->buckets));
+    assert(c->names && c->vars && c->buckets);
+    c->lru.next = c->lru.prev = &c->lru;
+    c->limit = max_bytes;
+    if (!cache_slots(expr, c)) {
+        cache_destroy(c);
+        return -1;
+    }
+    expr->cache = c;
+
+    return 0;
+}
+
+void express_cache_stats(struct express *expr, struct express_cache_stats *stats)
+{
+    if (expr->cache)
+        *stats = expr->cache->stats;
+    else
+        memset(stats, 0, sizeof(*stats));
+}
+
+value_t express_calculate(struct express *expr, fetch_value_fn fetcher, void *ctx)
+{
+    value_t v = express_eval(expr, fetcher, ctx);
     // 清空临时分配的内存
-    bufflist_clean(expr, stack[0].type == TV_STR ? stack[0].str : NULL);
+    bufflist_clean(expr, v.type == TV_STR ? v.str : NULL);
+
+    return v;
+}
+
+// 只折叠运算符和纯函数, 其他类型留到计算时
+static inline bool foldable(const struct token *t)
+{
+    if (t->type == OP_FUNC)
+        return t->fn->flags & EXPRESS_FN_PURE;
+    return t->type >= OP_NOT && t->type <= OP_OR;
+}
+
+// 计算时会出错的运算不折叠, 错误留到计算时
+static inline bool fold_safe(int type, value_t *arg)
+{
+    switch (type) {
+    case OP_MOD:
+        return LONG(1) != 0 && !(LONG(1) == -1 && LONG(0) == LONG_MIN);
+    case OP_SHIFTLEFT:case OP_SHIFTRIGHT:
+        return NUM(1) >= 0 && NUM(1) < sizeof(long) * CHAR_BIT;
+    default:
+        return true;
+    }
+}
+
+// 常量折叠, 参数都是常量的运算符和纯函数在创建时计算成常量
+static void express_fold(struct express *expr)
+{
+    size_t i = 0, j = 0, n = 0, nconst = 0; // nconst为栈顶连续的常量参数个数
+    struct token *rpn = expr->rpn;
+    value_t *arg = expr->stack, v;
+
+    for (i = 0; i < expr->size; i++) {
+        struct token t = rpn[i];
+        rpn[n++] = t;
+        if (t.type == OP_NUM || t.type == OP_STR) {
+            nconst++;
+            continue;
+        }
+        if (!foldable(&t) || nconst < t.nparam) {
+            nconst = 0;
+            continue;
+        }
+
+        // 参数是rpn中紧挨着的nparam个常量
+        n -= t.nparam + 1;
+        for (j = 0; j < t.nparam; j++)
+            arg[j] = token_eval(&rpn[n + j], NULL, expr, NULL, NULL);
+        if (!fold_safe(t.type, arg)) {
+            n += t.nparam + 1;
+            nconst = 0;
+            continue;
+        }
+        v = token_eval(&t, arg, expr, NULL, NULL);
+        memset(&rpn[n], 0, sizeof(rpn[n]));
+        if (v.type == TV_STR) {
+            rpn[n].type = OP_STR;
+            rpn[n].ptr  = v.str;
+            if (v.str) {
+                size_t len = strlen(v.str) + 1;
+                struct bufflist *b = malloc(sizeof(*b) + len);
+                assert(b);
+                memcpy(b->buff, v.str, len);
+                b->next = expr->pinned, expr->pinned = b;
+                rpn[n].ptr = b->buff;
+            }
+        } else {
+            rpn[n].type = OP_NUM;
+            rpn[n].num  = v.num;
+        }
+        bufflist_clean(expr, NULL);
+        n++;
+        nconst = nconst - t.nparam + 1;
+    }
+    expr->size = n;
+}
+
+// 计算每个子表达式的范围
+static struct incremental *incremental_create(struct express *expr)
+{
+    size_t i = 0, ss = 0, n = expr->size, *pos = NULL;
+    struct incremental *inc = calloc(1, sizeof(*inc));
+    assert(inc);
+    inc->start = calloc(n, sizeof(*inc->start));
+    inc->outer = calloc(n, sizeof(*inc->outer));
+    inc->down  = calloc(n, sizeof(*inc->down));
+    inc->dirty = calloc(n + 1, sizeof(*inc->dirty));
+    inc->cache = calloc(n, sizeof(*inc->cache));
+    inc->owned = calloc(n, sizeof(*inc->owned));
+    pos = calloc(n, sizeof(*pos)); // 栈中每个参数的起始位置
+    assert(inc->start && inc->outer && inc->down && inc->dirty && inc->cache && inc->owned && pos);
+
+    for (i = 0; i < n; i++)
+        inc->outer[i] = -1;
+    for (i = 0; i < n; i++) {
+        struct token *t = &expr->rpn[i];
+        assert(t->nparam <= ss);
+        ss -= t->nparam;
+        inc->start[i] = t->nparam ? pos[ss] : i;
+        pos[ss++] = inc->start[i];
+        // 起始位置相同的子表达式是嵌套的, 按结束位置串成链表
+        inc->down[i] = inc->outer[inc->start[i]];
+        inc->outer[inc->start[i]] = i;
+    }
+    free(pos);
+
+    return inc;
+}
+
+// 标记变化的叶子, time()等非纯函数总是需要重新计算
+static inline void incremental_mark(struct express *expr, const char *changed[])
+{
+    struct incremental *inc = expr->inc;
+    size_t i = 0, j = 0;
+    for (i = 0; i < expr->size; i++) {
+        struct token *t = &expr->rpn[i];
+        bool dirty = (t->type == OP_FUNC && !(t->fn->flags & EXPRESS_FN_PURE));
+        if ((t->type == OP_ID || t->type == OP_DICT) && changed) {
+            const char *name = t->type == OP_ID ? t->ptr : t->dict->name;
+            for (j = 0; !dirty && changed[j]; j++)
+                dirty = strcmp(changed[j], name) == 0;
+        }
+        inc->dirty[i + 1] = inc->dirty[i] + dirty;
+    }
+}
+
+#define DIRTY(inc, i) ((inc)->dirty[(i) + 1] > (inc)->dirty[(inc)->start[i]])
+
+// 保存子表达式的结果, 字符串复制一份, 保证下次计算时仍然有效
+static inline value_t incremental_store(struct incremental *inc, size_t i, struct token *t, value_t v)
+{
+    if (v.type == TV_STR && v.str && t->type != OP_STR) {
+        size_t len = strlen(v.str) + 1;
+        if (inc->owned[i].cap < len) {
+            free(inc->owned[i].ptr);
+            inc->owned[i].ptr = malloc(len);
+            assert(inc->owned[i].ptr);
+            inc->owned[i].cap = len;
+        }
+        memcpy(inc->owned[i].ptr, v.str, len);
+        v.str = inc->owned[i].ptr;
+    }
+
+    return inc->cache[i] = v;
+}
+
+value_t express_update(struct express *expr, const char *changed[], fetch_value_fn fetcher, void *ctx)
+{
+    size_t i = 0, ss = 0;
+    ssize_t k = -1;
+    value_t *stack = expr->stack, *arg = NULL;
+    struct incremental *inc = expr->inc;
+    struct token *t = NULL;
+    struct bufflist *mark = expr->list;
+
+    if (inc == NULL)
+        inc = expr->inc = incremental_create(expr);
+    incremental_mark(expr, changed);
+
+    for (i = 0; i < expr->size; ) {
+        // 从i开始的最大的没有变化的子表达式直接使用上次的结果
+        for (k = inc->ready ? inc->outer[i] : -1; k >= 0 && DIRTY(inc, k); k = inc->down[k])
+            ;
+        if (k >= 0) {
+            stack[ss++] = inc->cache[k];
+            i = k + 1;
+            continue;
+        }
+
+        t = &expr->rpn[i];
+        assert(t->nparam <= ss);
+        arg = stack + ss - t->nparam;
+        arg[0] = incremental_store(inc, i, t, token_eval(t, arg, expr, fetcher, ctx));
+        ss = ss + 1 - t->nparam;
+        assert(ss <= expr->size);
+        i++;
+    }
+
+    assert(ss == 1);
+    inc->ready = true;
+    // 结果都已经复制到cache中
+    bufflist_rollback(expr, mark);
 
     return stack[0];
 }
+
+#define IS_VAR(t, n) ((t)->type == OP_ID && strcmp((t)->ptr, (n)) == 0)
+// 创建字典引用, op为比较的token, arg为它的参数, 没有比较时op为NULL, name需要由expr持有
+static struct dict_ref *dict_create(struct express *expr, const char *name, const char *const *values,
+                                    size_t size, struct token *op, struct token *arg)
+{
+    size_t i = 0, j = 0, nparam = op ? op->nparam : 0;
+    struct bufflist *b = malloc(sizeof(*b) + sizeof(struct dict_ref) + nparam * sizeof(char *) + size);
+    struct dict_ref *d = (struct dict_ref *)b->buff;
+
+    assert(b);
+    b->next = expr->pinned, expr->pinned = b;
+    memset(d, 0, sizeof(*d));
+    d->name   = name;
+    d->values = values;
+    d->size   = size;
+    if (op == NULL)
+        return d;
+
+    d->op     = op->type;
+    d->swap   = !IS_VAR(&arg[0], name);
+    d->name   = d->swap ? arg[1].ptr : arg[0].ptr; // 调用者的name不一定一直有效
+    d->consts = (const char **)(d + 1);
+    d->table  = (unsigned char *)(d->consts + nparam);
+    for (i = 0; i < nparam; i++) {
+        if (arg[i].type == OP_STR)
+            d->consts[j++] = arg[i].ptr;
+    }
+    d->nconst = j;
+    for (i = 0; i < size; i++)
+        d->table[i] = dict_compare(d, STR_VAL(values[i])).num != 0;
+
+    return d;
+}
+
+// 判断op和它的参数是否是变量和常量字符串的比较
+static inline bool dict_pattern(struct token *op, struct token *arg, const char *name)
+{
+    size_t i = 0;
+    if (op->type == OP_FUNC && op->fn == &token_funcs[F_IN]) {
+        if (!IS_VAR(&arg[0], name))
+            return false;
+        for (i = 1; i < op->nparam; i++) {
+            if (arg[i].type != OP_STR)
+                return false;
+        }
+        return true;
+    }
+    if (op->type < OP_LT || op->type > OP_NOTEQ)
+        return false;
+
+    return (IS_VAR(&arg[0], name) && arg[1].type == OP_STR) || (arg[0].type == OP_STR && IS_VAR(&arg[1], name));
+}
+
+int express_bind_dict(struct express *expr, const char *name, const char *const *values, size_t size)
+{
+    size_t i = 0, n = 0;
+    int nsite = 0;
+    struct token *rpn = expr->rpn;
+    struct dict_ref *decode = NULL, *d = NULL;
+
+    for (i = 0; i < expr->size && !IS_VAR(&rpn[i], name); i++)
+        ;
+    if (i == expr->size)
+        return -1;
+    // rpn会改变, 增量计算的状态需要重建
+    incremental_destroy(expr->inc, expr->size);
+    expr->inc = NULL;
+
+    for (i = 0; i < expr->size; i++) {
+        struct token *t = &rpn[n];
+        *t = rpn[i];
+        if (!dict_pattern(t, t - t->nparam, name)) {
+            n++;
+            continue;
+        }
+        // 比较和它的参数替换成一个token
+        n -= t->nparam;
+        d = dict_create(expr, name, values, size, t, &rpn[n]);
+        memset(&rpn[n], 0, sizeof(rpn[n]));
+        rpn[n].type = OP_DICT;
+        rpn[n++].dict = d;
+        nsite++;
+    }
+    expr->size = n;
+
+    // 其他地方使用的变量解码成字符串
+    for (i = 0; i < n; i++) {
+        if (IS_VAR(&rpn[i], name)) {
+            if (decode == NULL)
+                decode = dict_create(expr, rpn[i].ptr, values, size, NULL, NULL);
+            memset(&rpn[i], 0, sizeof(rpn[i]));
+            rpn[i].type = OP_DICT;
+            rpn[i].dict = decode;
+        }
+    }
+    // 变量的值变成了字典下标, 缓存的键不再适用
+    if (expr->cache)
+        cache_reset(expr);
+
+    return nsite;
+}
+
+// 分组聚合的结果, groups按出现的顺序保存, index是指向groups的开放寻址哈希表
+struct express_groups {
+    struct express_group *groups;
+    size_t size;
+    size_t capacity;
+    uint32_t *index;            // groups的下标+1, 0为空
+    size_t mask;
+};
+
+void express_agg_init(struct express_agg *agg)
+{
+    memset(agg, 0, sizeof(*agg));
+    agg->min = HUGE_VAL;
+    agg->max = -HUGE_VAL;
+}
+
+// 累加一个结果, 真值和数值的转换规则和表达式计算一致
+static inline void agg_add(struct express_agg *agg, value_t v)
+{
+    double num = 0;
+    if (v.type == TV_NUM) {
+        num = v.num;
+        agg->count += (num != 0);
+    } else if (v.type == TV_STR && v.str) {
+        num = atof(v.str);
+        agg->count++;
+    }
+    agg->rows++;
+    agg->sum += num;
+    agg->min = num < agg->min ? num : agg->min;
+    agg->max = num > agg->max ? num : agg->max;
+}
+
+void express_aggregate(struct express *expr, fetch_value_fn fetcher, void *const *records, size_t n,
+                       struct express_agg *agg)
+{
+    size_t i = 0;
+    struct bufflist *mark = expr->list;
+    for (i = 0; i < n; i++) {
+        agg_add(agg, express_eval(expr, fetcher, records[i]));
+        bufflist_rollback(expr, mark);
+    }
+    agg->avg = agg->rows ? agg->sum / agg->rows : 0;
+}
+
+struct express_groups *express_groups_create(void)
+{
+    struct express_groups *g = calloc(1, sizeof(*g));
+    assert(g);
+    return g;
+}
+
+void express_groups_destroy(struct express_groups *g)
+{
+    size_t i = 0;
+    if (g == NULL)
+        return;
+    for (i = 0; i < g->size; i++)
+        free(g->groups[i].key);
+    free(g->groups);
+    free(g->index);
+    free(g);
+}
+
+const struct express_group *express_groups_result(struct express_groups *g, size_t *size)
+{
+    *size = g->size;
+    return g->groups;
+}
+
+static inline uint32_t *groups_slot(struct express_groups *g, const char *key, size_t len)
+{
+    size_t i = hash_bytes(key, len, HASH_INIT) & g->mask;
+    for (;; i = (i + 1) & g->mask) {
+        uint32_t idx = g->index[i];
+        if (idx == 0 || strcmp(g->groups[idx - 1].key, key) == 0)
+            return &g->index[i];
+    }
+}
+
+// 查找分组, 不存在时创建
+static struct express_agg *groups_find(struct express_groups *g, const char *key)
+{
+    size_t i = 0, len = strlen(key);
+    uint32_t *slot = NULL;
+    struct express_group *group = NULL;
+
+    // 负载超过一半时扩容
+    if (g->index == NULL || (g->size + 1) * 2 > g->mask + 1) {
+        g->mask = g->index ? g->mask * 2 + 1 : 63;
+        free(g->index);
+        g->index = calloc(g->mask + 1, sizeof(*g->index));
+        assert(g->index);
+        for (i = 0; i < g->size; i++)
+            *groups_slot(g, g->groups[i].key, strlen(g->groups[i].key)) = i + 1;
+    }
+    if (*(slot = groups_slot(g, key, len)))
+        return &g->groups[*slot - 1].agg;
+
+    if (g->size >= g->capacity) {
+        g->capacity = g->capacity * 1.5 + 8;
+        g->groups = realloc(g->groups, g->capacity * sizeof(*g->groups));
+        assert(g->groups);
+    }
+    group = &g->groups[g->size++];
+    group->key = malloc(len + 1);
+    assert(group->key);
+    memcpy(group->key, key, len + 1);
+    express_agg_init(&group->agg);
+    *slot = g->size;
+
+    return &group->agg;
+}
+
+void express_aggregate_by(struct express *expr, struct express *key, fetch_value_fn fetcher,
+                          void *const *records, size_t n, struct express_groups *g)
+{
+    size_t i = 0;
+    char buff[32];
+    struct bufflist *mark = expr->list, *kmark = key->list;
+    for (i = 0; i < n; i++) {
+        value_t k = express_eval(key, fetcher, records[i]);
+        const char *str = k.type == TV_STR ? (k.str ? k.str : "") : buff;
+        struct express_agg *agg = NULL;
+        if (k.type != TV_STR)
+            snprintf(buff, sizeof(buff), "%.15g", k.type == TV_NUM ? k.num : 0);
+        agg = groups_find(g, str);
+        bufflist_rollback(key, kmark);
+        agg_add(agg, express_eval(expr, fetcher, records[i]));
+        bufflist_rollback(expr, mark);
+    }
+    for (i = 0; i < g->size; i++) {
+        struct express_agg *agg = &g->groups[i].agg;
+        agg->avg = agg->rows ? agg->sum / agg->rows : 0;
+    }
+}
@@ -12,6 +12,8 @@
 #ifndef __EXPRESS_H__
 #define __EXPRESS_H__
 
+#include <stddef.h>
+
 enum {
     TV_NONE= 0, // 未赋值
     TV_NUM = 1, // 数字
@@ -28,6 +30,7 @@ struct token_value
 };
 
 typedef struct express express_t;
+typedef struct express_batch express_batch_t;
 
 /**
  * 用户提供的获取变量的回调, 如果返回的是字符串，字符串的生命周期至少要到
@@ -40,6 +43,36 @@ typedef struct express express_t;
  */
 typedef struct token_value (*fetch_value_fn)(void *ctx, const char *name);
 
+enum {
+    EXPRESS_FN_PURE = 1, // 纯函数: 相同的参数总是返回相同的结果，没有副作用
+};
+
+/**
+ * 用户注册的函数，返回字符串时生命周期的要求和fetch_value_fn一致
+ *
+ * @argv 参数
+ * @argc 参数个数, 在注册时的[min, max]范围内
+ * @udata 注册时传入的用户数据
+ * @return 返回函数的结果
+ */
+typedef struct token_value (*express_fn)(struct token_value *argv, size_t argc, void *udata);
+
+/**
+ * 注册函数，在express_create时解析为直接调用。参数都是常量的纯函数在
+ * express_create时计算成常量。函数注册后不能注销，注册不是线程安全的，
+ * 需要在创建表达式之前完成。
+ *
+ * @name 函数名, 由字母、数字、_、$、.组成, 不能以数字开头
+ * @func 函数实现
+ * @min 最少参数个数
+ * @max 最多参数个数
+ * @flags EXPRESS_FN_PURE 或者 0
+ * @udata 透传给func的用户数据
+ * @return 成功返回0，名字不合法或者已经存在返回-1
+ */
+int express_register_function(const char *name, express_fn func, size_t min, size_t max,
+                              int flags, void *udata);
+
 /**
  * 计算表达式， 返回结果
  * @expr 要计算的表达式
@@ -49,6 +82,61 @@ typedef struct token_value (*fetch_value_fn)(void *ctx, const char *name);
  */
 struct token_value express_calculate(express_t *expr, fetch_value_fn fetcher, void *ctx);
 
+/**
+ * 增量计算表达式，只重新计算依赖变化变量的子表达式，其余使用上次的结果。
+ * 第一次调用时完整计算，之后的调用只获取changed_vars中的变量，time()等
+ * 函数每次都会重新计算。和express_calculate的结果互不影响。
+ * 返回的字符串由表达式持有，到下次express_update或者销毁时失效。
+ *
+ * @expr 要计算的表达式
+ * @changed_vars 上次调用之后值变化的变量名，以NULL结尾，可以为NULL
+ * @fetcher 表达式中一些变量的获取函数
+ * @ctx 获取变量的上下文对象，透传给fetcher
+ * @return 返回计算结果
+ */
+struct token_value express_update(express_t *expr, const char *changed_vars[],
+                                  fetch_value_fn fetcher, void *ctx);
+
+/**
+ * 把变量绑定到字典，之后fetcher对这个变量返回TV_NUM的字典下标。变量和常量字符串
+ * 的比较(== != < <= > >=)以及in(变量, 常量字符串...)对每个字典项预先计算，计算时
+ * 只需要查表，其他地方使用的变量解码成字典中的字符串。fetcher返回的不是合法下标时
+ * 按原值计算。每个变量只能绑定一次。
+ *
+ * @expr 表达式
+ * @name 变量名
+ * @dict 字典，生命周期要长于expr，不能有NULL
+ * @size 字典的大小
+ * @return 返回预先计算的比较个数，表达式中没有这个变量返回-1
+ */
+int express_bind_dict(express_t *expr, const char *name, const char *const *dict, size_t size);
+
+// 结果缓存的统计
+struct express_cache_stats
+{
+    size_t hits;            // 命中次数
+    size_t misses;          // 未命中次数
+    size_t evictions;       // 因为内存上限淘汰的项数
+    size_t entries;         // 当前的项数
+    size_t bytes;           // 当前的项占用的内存
+};
+
+/**
+ * 打开结果缓存，之后express_calculate和聚合计算先获取所有变量的值，值和之前某次
+ * 相同时直接返回那次的结果，不再计算。超过内存上限时淘汰最久没有使用的项。
+ * 缓存命中时返回的字符串由缓存持有，到下次计算时失效。
+ *
+ * @expr 表达式
+ * @max_bytes 缓存项占用内存的上限，为0时关闭缓存
+ * @return 成功返回0，表达式中有time()等非纯函数时返回-1
+ */
+int express_cache_enable(express_t *expr, size_t max_bytes);
+
+/**
+ * 获取结果缓存的统计，没有打开缓存时全为0
+ */
+void express_cache_stats(express_t *expr, struct express_cache_stats *stats);
+
 /**
  * 创建一个表达式
  * @expr 要解析的表达式字符串
@@ -57,8 +145,91 @@ struct token_value express_calculate(express_t *expr, fetch_value_fn fetcher, vo
 express_t *express_create(const char *expr);
 
 /**
- * 销毁表达式对象
+ * 销毁表达式对象, express_compile_many创建的表达式不需要单独销毁
  */
 void express_destroy(express_t *expr);
 
+/**
+ * 批量编译表达式，所有表达式分配在批量对象持有的内存中，编译时复用临时缓冲区。
+ * 多线程编译时注册的纯函数可能在多个线程中被同时调用(常量折叠)。
+ *
+ * @exprs 要解析的表达式字符串数组
+ * @n 表达式个数
+ * @out 输出表达式对象，out[i]对应exprs[i]，有错误的为NULL
+ * @errpos 可以为NULL，输出每个表达式出错的token的位置(字符偏移)，成功的为-1，
+ *         缺少右操作数或者括号不匹配等到结尾才能发现的错误为表达式的长度
+ * @nthreads 编译使用的线程数，小于等于1时在当前线程编译
+ * @return 返回批量对象，用express_batch_destroy一起销毁所有的表达式
+ */
+express_batch_t *express_compile_many(const char *const *exprs, size_t n, express_t **out,
+                                      long *errpos, int nthreads);
+
+/**
+ * 销毁express_compile_many返回的批量对象和其中所有的表达式
+ */
+void express_batch_destroy(express_batch_t *batch);
+
+// 聚合结果
+struct express_agg
+{
+    size_t rows;            // 计算的记录数
+    size_t count;           // 结果为真的记录数
+    double sum;             // 结果的数值之和, 字符串按atof转换
+    double min;             // 最小值, 没有记录时为HUGE_VAL
+    double max;             // 最大值, 没有记录时为-HUGE_VAL
+    double avg;             // sum / rows
+};
+
+struct express_group
+{
+    char *key;              // 分组的键, 数字会格式化成字符串
+    struct express_agg agg; // 该分组的聚合结果
+};
+
+typedef struct express_groups express_groups_t;
+
+/**
+ * 初始化聚合结果
+ */
+void express_agg_init(struct express_agg *agg);
+
+/**
+ * 对每条记录计算表达式并把结果累加到agg中，可以多次调用处理分批到来的记录
+ * @expr 要计算的表达式
+ * @fetcher 表达式中一些变量的获取函数
+ * @records 记录数组，每条记录作为ctx传给fetcher
+ * @n 记录数
+ * @agg 累加的聚合结果，第一次使用前用express_agg_init初始化
+ */
+void express_aggregate(express_t *expr, fetch_value_fn fetcher, void *const *records, size_t n,
+                       struct express_agg *agg);
+
+/**
+ * 创建分组聚合的结果集合
+ */
+express_groups_t *express_groups_create(void);
+
+/**
+ * 按key表达式的结果分组聚合，可以多次调用处理分批到来的记录
+ * @expr 要聚合的表达式
+ * @key 计算分组键的表达式
+ * @fetcher 表达式中一些变量的获取函数
+ * @records 记录数组，每条记录作为ctx传给fetcher
+ * @n 记录数
+ * @groups 累加的分组结果
+ */
+void express_aggregate_by(express_t *expr, express_t *key, fetch_value_fn fetcher,
+                          void *const *records, size_t n, express_groups_t *groups);
+
+/**
+ * 返回分组结果，按分组第一次出现的顺序排列，在下次express_aggregate_by之前有效
+ * @size 输出分组个数
+ */
+const struct express_group *express_groups_result(express_groups_t *groups, size_t *size);
+
+/**
+ * 销毁分组结果
+ */
+void express_groups_destroy(express_groups_t *groups);
+
 #endif /* __EXPRESS_H__ */